@@ -9,11 +9,13 @@
 #include <QDebug>
 #include <QDialog>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
 #include <QIcon>
 #include <QKeyEvent>
 #include <QKeySequence>
 #include <QLineEdit>
+#include <QList>
 #include <QMenu>
 #include <QMessageBox>
 #include <QPainter>
@@ -25,7 +27,11 @@
 #include <QSystemTrayIcon>
 #include <QTimer>
 #include <QVBoxLayout>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <thread>
 #include <windows.h>
 #include <QDesktopServices>
@@ -40,6 +46,9 @@ const QString DEFAULT_COLOR_OFF                 = "#181a1b";
 const QString DEFAULT_COLOR_FULLSCREEN          = "#e8e6e3";
 const QString DEFAULT_COLOR_FULLSCREEN_WINDOWED = "#76b900";
 
+const std::chrono::milliseconds DRIVER_QUERY_RETRY_DELAY{1000};
+const std::chrono::milliseconds DRIVER_QUERY_MAX_RETRY_DELAY{8000};
+
 class KeyBindingDialog : public QDialog
 {
     Q_OBJECT
@@ -101,12 +110,18 @@ class GSyncTrayIcon : public QSystemTrayIcon
 {
     Q_OBJECT
 public:
-    explicit GSyncTrayIcon(QObject* parent = nullptr)
+    explicit GSyncTrayIcon(const QElapsedTimer& startupTimer, QObject* parent = nullptr)
         : QSystemTrayIcon(parent)
+        , m_startupTimer(startupTimer)
     {
+        // Show the last-known mode right away; the driver is queried in the background and reconciled later
+        m_currentMode = m_settings.value("current_gsync_mode", static_cast<int>(VRR_MODE_DEFAULT)).toInt();
+
         setupMenu();
         setupIcon();
         updateIconColor();
+        updateMenuCheckmarks(m_currentMode);
+        updateTooltip(m_currentMode);
 
         connect(this, &QSystemTrayIcon::activated, this, [this](QSystemTrayIcon::ActivationReason reason) {
             if (reason == QSystemTrayIcon::Trigger)
@@ -116,35 +131,18 @@ public:
             }
         });
 
-        try
-        {
-            NvApiWrapper       nvapi;
-            NvApiDrsSession    drs_session;
-            NvDRSProfileHandle drs_profile{nullptr};
-            NVDRS_SETTING      drs_setting{};
-
-            drs_setting.version = NVDRS_SETTING_VER;
-            assertSuccess(nvapi.DRS_LoadSettings(drs_session), "Failed to load session settings!");
-            assertSuccess(nvapi.DRS_GetBaseProfile(drs_session, &drs_profile), "Failed to get base profile!");
-
-            NvU32      currentValue{VRR_MODE_DEFAULT};
-            const auto status{nvapi.DRS_GetSetting(drs_session, drs_profile, VRR_MODE_ID, &drs_setting)};
-            if (status != NVAPI_SETTING_NOT_FOUND)
-            {
-                assertSuccess(status, "Failed to get VRR setting!");
-                currentValue = drs_setting.u32CurrentValue;
-            }
-
-            updateTooltip(currentValue);
-        }
-        catch (const std::exception& error)
-        {
-            QMessageBox::critical(nullptr, "Error", error.what());
-        }
+        startDriverQuery();
     }
 
     ~GSyncTrayIcon()
     {
+        // The query thread is detached and may outlive us, so only stop it from posting back here
+        {
+            std::lock_guard lock(m_driverQuery->mutex);
+            m_driverQuery->cancelled = true;
+        }
+        m_driverQuery->cancelledChanged.notify_all();
+
         for (auto* hotkey : m_hotkeys)
         {
             delete hotkey;
@@ -155,58 +153,43 @@ public:
 private slots:
     void onGSyncModeChanged(int mode)
     {
-        try
+        if (!m_driverStateConfirmed)
         {
-            NvApiWrapper       nvapi;
-            NvApiDrsSession    drs_session;
-            NvDRSProfileHandle drs_profile{nullptr};
-            NVDRS_SETTING      drs_setting{};
-
-            drs_setting.version = NVDRS_SETTING_VER;
-            assertSuccess(nvapi.DRS_LoadSettings(drs_session), "Failed to load session settings!");
-            assertSuccess(nvapi.DRS_GetBaseProfile(drs_session, &drs_profile), "Failed to get base profile!");
-
-            if (mode == -1)
-            {
-                NvU32      currentValue{VRR_MODE_DEFAULT};
-                const auto status{nvapi.DRS_GetSetting(drs_session, drs_profile, VRR_MODE_ID, &drs_setting)};
-                if (status != NVAPI_SETTING_NOT_FOUND)
-                {
-                    assertSuccess(status, "Failed to get VRR setting!");
-                    currentValue = drs_setting.u32CurrentValue;
-                }
-
-                if (currentValue == 1 || currentValue == 2)
-                {
-                    mode = 0;
-                }
-                else
-                {
-                    mode = m_settings.value("last_gsync_mode", 2).toInt();
-                }
-            }
+            qDebug() << "Queueing G-Sync mode change until driver state is confirmed:" << mode;
+            m_pendingModes.append(mode);
+            return;
+        }
 
-            drs_setting.settingId       = VRR_MODE_ID;
-            drs_setting.settingType     = NVDRS_DWORD_TYPE;
-            drs_setting.settingLocation = NVDRS_CURRENT_PROFILE_LOCATION;
-            drs_setting.u32CurrentValue = mode;
+        setGSyncMode(mode);
+    }
 
-            assertSuccess(nvapi.DRS_SetSetting(drs_session, drs_profile, &drs_setting), "Failed to set VRR setting!");
-            assertSuccess(nvapi.DRS_SaveSettings(drs_session), "Failed to save session settings!");
+    void onDriverQueryFailed()
+    {
+        if (!m_driverQueryFailed)
+        {
+            m_driverQueryFailed = true;
+            updateTooltip(m_currentMode);
+        }
+    }
 
-            if (mode != -1 && mode != 0)
-            {
-                m_settings.setValue("last_gsync_mode", mode);
-            }
+    void onDriverStateQueried(int mode)
+    {
+        qDebug() << "Time to confirmed state:" << m_startupTimer.elapsed() << "ms";
 
-            updateIconColor();
-            updateMenuCheckmarks(mode);
-            updateTooltip(mode);
+        if (mode != m_currentMode)
+        {
+            qDebug() << "Correcting last-known G-Sync mode" << m_currentMode << "to driver state" << mode;
         }
-        catch (const std::exception& error)
+        m_driverQueryFailed = false;
+        applyMode(mode);
+
+        // Changes made while an error box is open here still land at the end of this queue
+        while (!m_pendingModes.isEmpty())
         {
-            QMessageBox::critical(nullptr, "Error", error.what());
+            setGSyncMode(m_pendingModes.takeFirst());
         }
+
+        m_driverStateConfirmed = true;
     }
 
     void onStartupToggled(bool checked)
@@ -290,7 +273,8 @@ private slots:
     {
         static const QString statusStrings[] = {"G-Sync off", "G-Sync fullscreen only",
                                                 "G-Sync fullscreen and windowed"};
-        setToolTip(statusStrings[mode >= 0 && mode < 3 ? mode : 0]);
+        const QString status = statusStrings[mode >= 0 && mode < 3 ? mode : 0];
+        setToolTip(m_driverQueryFailed ? QString("%1 (unconfirmed)").arg(status) : status);
     }
 
 private:
@@ -462,63 +446,19 @@ private:
         fullscreenAction->setCheckable(true);
         fullscreenWindowedAction->setCheckable(true);
 
-        try
-        {
-            NvApiWrapper       nvapi;
-            NvApiDrsSession    drs_session;
-            NvDRSProfileHandle drs_profile{nullptr};
-            NVDRS_SETTING      drs_setting{};
-
-            drs_setting.version = NVDRS_SETTING_VER;
-            assertSuccess(nvapi.DRS_LoadSettings(drs_session), "Failed to load session settings!");
-            assertSuccess(nvapi.DRS_GetBaseProfile(drs_session, &drs_profile), "Failed to get base profile!");
-
-            NvU32      currentValue{VRR_MODE_DEFAULT};
-            const auto status{nvapi.DRS_GetSetting(drs_session, drs_profile, VRR_MODE_ID, &drs_setting)};
-            if (status != NVAPI_SETTING_NOT_FOUND)
-            {
-                assertSuccess(status, "Failed to get VRR setting!");
-                currentValue = drs_setting.u32CurrentValue;
-            }
-
-            switch (currentValue)
-            {
-                case 0:
-                    offAction->setChecked(true);
-                    break;
-                case 1:
-                    fullscreenAction->setChecked(true);
-                    break;
-                case 2:
-                    fullscreenWindowedAction->setChecked(true);
-                    break;
-            }
-        }
-        catch (const std::exception& error)
-        {
-            QMessageBox::critical(nullptr, "Error", error.what());
-        }
-
-        connect(offAction, &QAction::triggered, this, [this, offAction, fullscreenAction, fullscreenWindowedAction]() {
+        // Triggering toggles the checkable action itself, so restore the marks from the applied mode
+        connect(offAction, &QAction::triggered, this, [this]() {
             onGSyncModeChanged(0);
-            offAction->setChecked(true);
-            fullscreenAction->setChecked(false);
-            fullscreenWindowedAction->setChecked(false);
+            updateMenuCheckmarks(m_currentMode);
+        });
+        connect(fullscreenAction, &QAction::triggered, this, [this]() {
+            onGSyncModeChanged(1);
+            updateMenuCheckmarks(m_currentMode);
+        });
+        connect(fullscreenWindowedAction, &QAction::triggered, this, [this]() {
+            onGSyncModeChanged(2);
+            updateMenuCheckmarks(m_currentMode);
         });
-        connect(fullscreenAction, &QAction::triggered, this,
-                [this, offAction, fullscreenAction, fullscreenWindowedAction]() {
-                    onGSyncModeChanged(1);
-                    offAction->setChecked(false);
-                    fullscreenAction->setChecked(true);
-                    fullscreenWindowedAction->setChecked(false);
-                });
-        connect(fullscreenWindowedAction, &QAction::triggered, this,
-                [this, offAction, fullscreenAction, fullscreenWindowedAction]() {
-                    onGSyncModeChanged(2);
-                    offAction->setChecked(false);
-                    fullscreenAction->setChecked(false);
-                    fullscreenWindowedAction->setChecked(true);
-                });
 
         setContextMenu(menu);
     }
@@ -553,7 +493,7 @@ private:
         }
     }
 
-    void updateIconColor()
+    void setGSyncMode(int mode)
     {
         try
         {
@@ -566,31 +506,33 @@ private:
             assertSuccess(nvapi.DRS_LoadSettings(drs_session), "Failed to load session settings!");
             assertSuccess(nvapi.DRS_GetBaseProfile(drs_session, &drs_profile), "Failed to get base profile!");
 
-            NvU32      currentValue{VRR_MODE_DEFAULT};
-            const auto status{nvapi.DRS_GetSetting(drs_session, drs_profile, VRR_MODE_ID, &drs_setting)};
-            if (status != NVAPI_SETTING_NOT_FOUND)
+            if (mode == -1)
             {
-                assertSuccess(status, "Failed to get VRR setting!");
-                currentValue = drs_setting.u32CurrentValue;
+                const NvU32 currentValue{getVrrMode(nvapi, drs_session, drs_profile)};
+                if (currentValue == 1 || currentValue == 2)
+                {
+                    mode = 0;
+                }
+                else
+                {
+                    mode = m_settings.value("last_gsync_mode", 2).toInt();
+                }
             }
 
-            QString color = getColorForMode(currentValue);
-
-            QString coloredSvg = m_iconSvg;
-            coloredSvg.replace("fill:#000000", QString("fill:%1").arg(color));
-            coloredSvg.replace("stroke:#000000", QString("stroke:%1").arg(color));
-
-            QPixmap pixmap(32, 32);
-            pixmap.fill(Qt::transparent);
+            drs_setting.settingId       = VRR_MODE_ID;
+            drs_setting.settingType     = NVDRS_DWORD_TYPE;
+            drs_setting.settingLocation = NVDRS_CURRENT_PROFILE_LOCATION;
+            drs_setting.u32CurrentValue = mode;
 
-            QSvgRenderer renderer(coloredSvg.toUtf8());
-            QPainter     painter(&pixmap);
-            renderer.render(&painter);
+            assertSuccess(nvapi.DRS_SetSetting(drs_session, drs_profile, &drs_setting), "Failed to set VRR setting!");
+            assertSuccess(nvapi.DRS_SaveSettings(drs_session), "Failed to save session settings!");
 
-            if (!pixmap.isNull())
+            if (mode != -1 && mode != 0)
             {
-                setIcon(QIcon(pixmap));
+                m_settings.setValue("last_gsync_mode", mode);
             }
+
+            applyMode(mode);
         }
         catch (const std::exception& error)
         {
@@ -598,6 +540,105 @@ private:
         }
     }
 
+    void startDriverQuery()
+    {
+        // Retries until the driver answers or the tray is destroyed; the driver service may still be starting
+        std::thread([this, query = m_driverQuery]() {
+            auto retryDelay = DRIVER_QUERY_RETRY_DELAY;
+            for (int attempt = 1;; ++attempt)
+            {
+                try
+                {
+                    const int mode{queryDriverMode()};
+
+                    std::lock_guard lock(query->mutex);
+                    if (!query->cancelled)
+                    {
+                        QMetaObject::invokeMethod(
+                            this, [this, mode]() { onDriverStateQueried(mode); }, Qt::QueuedConnection);
+                    }
+                    return;
+                }
+                catch (const std::exception& error)
+                {
+                    qDebug() << "Driver state query attempt" << attempt << "failed:" << error.what();
+                }
+
+                std::unique_lock lock(query->mutex);
+                if (query->cancelled)
+                {
+                    return;
+                }
+
+                QMetaObject::invokeMethod(this, [this]() { onDriverQueryFailed(); }, Qt::QueuedConnection);
+                if (query->cancelledChanged.wait_for(lock, retryDelay, [&query]() { return query->cancelled; }))
+                {
+                    return;
+                }
+                retryDelay = std::min(retryDelay * 2, DRIVER_QUERY_MAX_RETRY_DELAY);
+            }
+        }).detach();
+    }
+
+    static NvU32 getVrrMode(NvApiWrapper& nvapi, NvApiDrsSession& drs_session, NvDRSProfileHandle drs_profile)
+    {
+        NVDRS_SETTING drs_setting{};
+        drs_setting.version = NVDRS_SETTING_VER;
+
+        NvU32      currentValue{VRR_MODE_DEFAULT};
+        const auto status{nvapi.DRS_GetSetting(drs_session, drs_profile, VRR_MODE_ID, &drs_setting)};
+        if (status != NVAPI_SETTING_NOT_FOUND)
+        {
+            assertSuccess(status, "Failed to get VRR setting!");
+            currentValue = drs_setting.u32CurrentValue;
+        }
+
+        return currentValue;
+    }
+
+    static int queryDriverMode()
+    {
+        NvApiWrapper       nvapi;
+        NvApiDrsSession    drs_session;
+        NvDRSProfileHandle drs_profile{nullptr};
+
+        assertSuccess(nvapi.DRS_LoadSettings(drs_session), "Failed to load session settings!");
+        assertSuccess(nvapi.DRS_GetBaseProfile(drs_session, &drs_profile), "Failed to get base profile!");
+
+        return static_cast<int>(getVrrMode(nvapi, drs_session, drs_profile));
+    }
+
+    void applyMode(int mode)
+    {
+        m_currentMode = mode;
+        m_settings.setValue("current_gsync_mode", mode);
+
+        updateIconColor();
+        updateMenuCheckmarks(mode);
+        updateTooltip(mode);
+    }
+
+    void updateIconColor()
+    {
+        QString color = getColorForMode(m_currentMode);
+
+        QString coloredSvg = m_iconSvg;
+        coloredSvg.replace("fill:#000000", QString("fill:%1").arg(color));
+        coloredSvg.replace("stroke:#000000", QString("stroke:%1").arg(color));
+
+        QPixmap pixmap(32, 32);
+        pixmap.fill(Qt::transparent);
+
+        QSvgRenderer renderer(coloredSvg.toUtf8());
+        QPainter     painter(&pixmap);
+        renderer.render(&painter);
+
+        if (!pixmap.isNull())
+        {
+            setIcon(QIcon(pixmap));
+        }
+    }
+
     QString getColorForMode(int mode)
     {
         static const QString defaultColors[] = {DEFAULT_COLOR_OFF, DEFAULT_COLOR_FULLSCREEN,
@@ -624,15 +665,31 @@ private:
         }
     }
 
-    QByteArray       m_iconSvg;
-    QList<QHotkey*>  m_hotkeys;
-    static QSettings m_settings;
+    struct DriverQuery
+    {
+        std::mutex              mutex;
+        std::condition_variable cancelledChanged;
+        bool                    cancelled{false};
+    };
+
+    QByteArray                   m_iconSvg;
+    QList<QHotkey*>              m_hotkeys;
+    int                          m_currentMode{0};
+    bool                         m_driverStateConfirmed{false};
+    bool                         m_driverQueryFailed{false};
+    QList<int>                   m_pendingModes;
+    QElapsedTimer                m_startupTimer;
+    std::shared_ptr<DriverQuery> m_driverQuery{std::make_shared<DriverQuery>()};
+    static QSettings             m_settings;
 };
 
 QSettings GSyncTrayIcon::m_settings("HKEY_CURRENT_USER\\Software\\GSyncToggle", QSettings::NativeFormat);
 
 int main(int argc, char** argv)
 {
+    QElapsedTimer startupTimer;
+    startupTimer.start();
+
     QApplication app(argc, argv);
     app.setQuitOnLastWindowClosed(false);
 
@@ -655,9 +712,13 @@ int main(int argc, char** argv)
         }
     }
 
-    GSyncTrayIcon trayIcon;
+    GSyncTrayIcon trayIcon(startupTimer);
     trayIcon.show();
 
+    QTimer::singleShot(0, &trayIcon, [&startupTimer]() {
+        qDebug() << "Time to first icon:" << startupTimer.elapsed() << "ms";
+    });
+
     return app.exec();
 }
 